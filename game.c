@@ -2,6 +2,15 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /**
     Exit codes for error conditions
@@ -13,7 +22,15 @@ typedef enum {
     GRID_DIMENSIONS = 3,
     FILE_READ = 4,
     INVALID_FILE = 5,
-    EOF_ERROR = 6
+    EOF_ERROR = 6,
+    BOOK_USAGE = 7,
+    BOOK_READ = 8,
+    BOOK_WRITE = 9,
+    BENCH_USAGE = 10,
+    KERNEL_MISMATCH = 11,
+    TOURNAMENT_USAGE = 12,
+    TOURNAMENT_LOG = 13,
+    REPLAY_USAGE = 14
 } ErrorCode;
 
 /**
@@ -21,10 +38,133 @@ typedef enum {
 **/
 typedef struct Player {
     bool isManual; // true if the player is manual
+    bool useBook; // true if the player consults the opening book first
     int moveCounter;
     char playerName;
 } Player;
 
+/**
+    Header at the start of an opening book file. The header is followed by
+    the bucket directory ((1 << bucketBits) + 1 offsets into the entry
+    array) and then the entries themselves, sorted by key.
+**/
+typedef struct BookHeader {
+    char magic[8];
+    uint32_t height;
+    uint32_t width;
+    uint32_t bucketBits;
+    uint32_t entryCount;
+} BookHeader;
+
+/**
+    A single opening book entry: the best known move for a position
+    and the self-play results that move was chosen from
+**/
+typedef struct BookEntry {
+    uint64_t key;
+    uint16_t row;
+    uint16_t column;
+    uint32_t wins;
+    uint32_t visits;
+    uint32_t padding;
+} BookEntry;
+
+/**
+    A read-only, memory mapped opening book
+**/
+typedef struct Book {
+    void* map;
+    size_t mapSize;
+    const BookHeader* header;
+    const uint32_t* buckets;
+    const BookEntry* entries;
+} Book;
+
+struct Game;
+
+/**
+    The board operations that have specialised implementations for the
+    standard board sizes. A game selects its kernels once, when it is
+    initialized, and every call goes through them afterwards.
+**/
+typedef struct Kernels {
+    const char* name;
+    bool (*is_move_valid)(int height, int width, struct Game* game);
+    bool (*check_game_over)(int row, int column, char value,
+            struct Game* game);
+    // returns the winner of a filled board
+    char (*find_winner)(struct Game* game);
+    // plays random moves to the end of the game without changing the board
+    // and returns the winner
+    char (*playout)(struct Game* game, uint64_t* seed);
+    void (*print_game)(struct Game* game);
+} Kernels;
+
+/**
+    Number of items the output queue holds
+**/
+#define WRITER_CAPACITY 256
+
+typedef enum {
+    ITEM_MOVE,
+    ITEM_FRAME,
+    ITEM_LINE,
+    ITEM_STOP
+} ItemType;
+
+/**
+    A move, board frame or line of text waiting to be written out. Moves
+    only carry the stone placed, which the writer applies to its own copy
+    of the board, so items stay small whatever the board size.
+**/
+typedef struct WriterItem {
+    ItemType type;
+    // the stone placed, for moves
+    int row;
+    int column;
+    char value;
+    // the turn and formula counters after the move, for frames
+    bool isXTurn;
+    int moveCounters[2];
+    // true if the frame must not be dropped
+    bool final;
+    char line[80];
+} WriterItem;
+
+/**
+    Things a thread can wait for on the writer
+**/
+typedef enum {
+    WAIT_ITEMS,
+    WAIT_SPACE,
+    WAIT_DRAINED
+} WaitReason;
+
+/**
+    Prints and autosaves the game on its own thread, so slow terminals,
+    pipes or disks do not hold up the moves. The game thread publishes
+    items into a single producer, single consumer ring buffer that needs
+    no locks: only the game thread writes 'head' and only the writer
+    thread writes 'tail'. The lock is only taken to sleep, when the queue
+    is empty, full or being drained, and to wake a sleeping thread.
+**/
+typedef struct Writer {
+    pthread_t thread;
+    WriterItem items[WRITER_CAPACITY];
+    // the writer's own copy of the game, which frames are rendered from
+    struct Game* game;
+    size_t head;
+    size_t tail;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    // number of threads sleeping on 'changed'
+    int sleepers;
+    bool dropFrames;
+    const char* autosaveName;
+    // true once an autosave has failed and been reported
+    bool autosaveFailed;
+} Writer;
+
 /**
     Contains the information about the game
 **/
@@ -32,38 +172,42 @@ typedef struct Game {
     int height;
     int width;
     char** board;
+    // the board surrounded by a border of '#' cells, one row per 'stride'
+    // characters. The rows of 'board' point into it.
+    char* cells;
+    int stride;
+    const Kernels* kernels;
     Player* players[2];
     bool isXTurn; // true if the currently player playing is X
     char winner;
+    // zobrist hash of the stones on the board, used for book lookups
+    uint64_t hash;
+    // opening book shared by the players, NULL if none is loaded
+    Book* book;
+    // output thread, NULL if the game prints synchronously
+    Writer* writer;
+    // scratch buffers the size of 'cells' for the generic kernels: flood
+    // fill marks and stack, and a board to play random games out on
+    unsigned char* visited;
+    int* flood;
+    char* scratch;
+    // rendered frame, allocated when the generic kernels first print
+    char* frame;
 } Game;
 
-/**
-    This data structure is used to determine the end game conditions.
-**/
-typedef struct Stack {
-    // the row values of the cells on the game board
-    int* rows;
-    // the column values of the cells
-    int* columns;
-    // a log of all the visited cell row values
-    int* rowLog;
-    // log of all the visited cell column values
-    int* columnLog;
-    // number of cells visited
-    int logCount;
-    // maximum size of the log array
-    int logSize;
-    // the number of elements currently in the stack
-    int count;
-    // capacity of the stack
-    int maxSize;
-} Stack;
-
 char** split_string(char*, int*, char*);
 
 void free_game(Game*);
 
-void free_stack(Stack*);
+void free_book(Book*);
+
+uint64_t board_key(int height, int width);
+
+uint64_t cell_key(int row, int column, char value);
+
+const Kernels* select_kernels(int height, int width);
+
+bool is_player_type_valid(char type);
 
 /**
     Initializes the game using the given height and width parameters
@@ -74,17 +218,29 @@ Game* initialize_game(int height, int width) {
     game->height = height;
     game->width = width;
     game->isXTurn = false;
+    game->stride = width + 2;
+    game->cells = malloc(sizeof(char) * game->stride * (height + 2));
+    memset(game->cells, '#', game->stride * (height + 2));
     game->board = malloc(sizeof(char*) * height);
     for (int i = 0; i < height; i++) {
-        game->board[i] = malloc(sizeof(char) * width);
+        game->board[i] = game->cells + (i + 1) * game->stride + 1;
         memset(game->board[i], '.', width);
     }
+    game->kernels = select_kernels(height, width);
+    game->visited = malloc(sizeof(unsigned char) * game->stride
+            * (height + 2));
+    game->flood = malloc(sizeof(int) * game->stride * (height + 2));
+    game->scratch = malloc(sizeof(char) * game->stride * (height + 2));
+    game->frame = NULL;
 
     game->players[0] = malloc(sizeof(Player));
     game->players[1] = malloc(sizeof(Player));
     game->players[0]->playerName = 'O';
     game->players[1]->playerName = 'X';
     game->winner = '.';
+    game->hash = board_key(height, width);
+    game->book = NULL;
+    game->writer = NULL;
 
     return game;
 }
@@ -94,6 +250,7 @@ Game* initialize_game(int height, int width) {
 **/
 void initialize_player(char* playerType, Player* player, int moves) {
     player->moveCounter = moves;
+    player->useBook = (playerType[0] == 'b');
     if (playerType[0] == 'm') {
         player->isManual = true;
     } else {
@@ -101,39 +258,11 @@ void initialize_player(char* playerType, Player* player, int moves) {
     }
 }
 
-/**
-    Initializes the stack used for game end detection
-**/
-Stack* initialize_stack(Game* game) {
-    Stack* stack = malloc(sizeof(Stack));
-    stack->rows = malloc(sizeof(int) * (game->height * game->width));
-    stack->columns = malloc(sizeof(int) * (game->height * game->width));
-    stack->rowLog = malloc(sizeof(int) * (game->height * game->width));
-    stack->columnLog = malloc(sizeof(int) * (game->height * game->width));
-    stack->count = 0;
-    stack->logCount = 0;
-    stack->logSize = game->height * game->width;
-    stack->maxSize = game->height * game->width;
-
-    return stack;
-}
-
 /**
     Prints the game board
 **/
 void print_game(Game* game) {
-    for (int i = 0; i < game->height; i++) {
-        for (int j = 0; j < (game->height) - 1 - i; j++) {
-            printf(" ");
-        }
-        for (int j = 0; j < game->width; j++) {
-            printf("%c", game->board[i][j]);
-            if (j < game->width - 1) {
-                printf(" ");
-            }
-        }
-        printf("\n");
-    }
+    game->kernels->print_game(game);
 }
 
 /**
@@ -162,6 +291,32 @@ int show_error_message(ErrorCode e) {
         case EOF_ERROR:
             message = "EOF from user\n";
             break;
+        case BOOK_USAGE:
+            message = "Usage: hex book bookfile height width "
+                    "[games plies [minVisits]]\n";
+            break;
+        case BOOK_READ:
+            message = "Could not load opening book\n";
+            break;
+        case BOOK_WRITE:
+            message = "Could not write opening book\n";
+            break;
+        case BENCH_USAGE:
+            message = "Usage: hex bench height width [iterations]\n";
+            break;
+        case KERNEL_MISMATCH:
+            message = "Specialised kernels disagree with the generic ones\n";
+            break;
+        case TOURNAMENT_USAGE:
+            message = "Usage: hex tournament p1type p2type height width "
+                    "logfile [games [seed [openingPlies]]]\n";
+            break;
+        case TOURNAMENT_LOG:
+            message = "Could not write tournament log\n";
+            break;
+        case REPLAY_USAGE:
+            message = "Usage: hex replay logfile game\n";
+            break;
     }
     fprintf(stderr, "%s", message);
     return e;
@@ -185,6 +340,7 @@ int add_row_from_file(char* line, int* lineCount, Game* game) {
             return -1;
         }
         game->board[*lineCount - 1][i] = line[i];
+        game->hash ^= cell_key(*lineCount - 1, i, line[i]);
     }
     return 0;
 }
@@ -196,7 +352,7 @@ int load_game(FILE* gameFile, Game** game) {
     char line[150];
     int tokenCount = 0, playerTurn = 0, lineIndex = 0;
     char* error = 0;
-    int height, width, oMoveCount, xMoveCount;
+    int height, width, oMoveCount = 0, xMoveCount = 0;
     while (fgets(line, 145, gameFile) != NULL) {
         if (lineIndex == 0) {
             char** lineSplit = split_string(line, &tokenCount, ",");
@@ -241,338 +397,1348 @@ int load_game(FILE* gameFile, Game** game) {
 }
 
 /**
-    Adds a cell's row and column values to the stack,
-    and returns the updated stack. Stack remains unchanged for
-    duplicate additions.
+    Checks the game over conditions after every move and returns true if the
+    game is over.
+**/
+bool check_game_over(int row, int column, char value, Game* game) {
+    return game->kernels->check_game_over(row, column, value, game);
+}
+
+/**
+    Returns true if the move currently generated or 
+    obtained from stdin is valid.
+**/
+bool is_move_valid(int height, int width, Game* game) {
+    return game->kernels->is_move_valid(height, width, game);
+}
+
+/**
+    Checks a move on a board of any size
 **/
-Stack* push(Stack* stack, int row, int column) {
-    if (stack->count == stack->maxSize) {
-        return stack;
+bool is_move_valid_generic(int height, int width, Game* game) {
+    if (height >= game->height || width >= game->width) {
+        return false;
     }
-    if (stack->logCount == stack->maxSize) {
-        stack->rowLog = realloc(stack->rowLog, stack->logSize * 2);
-        stack->columnLog = realloc(stack->columnLog, stack->logSize * 2);
-        stack->logSize *= 2;
+    if (height < 0 || width < 0) {
+        return false;
     }
-    for (int i = 0; i < stack->logCount; i++) {
-        if (stack->rowLog[i] == row && stack->columnLog[i] == column) {
-            return stack;
-        }
+    if (game->board[height][width] != '.') {
+        return false;
+    }
+    return true;
+}
+
+/**
+    Generates the automatic move for player O
+**/
+void get_auto_move_for_o(int* height, int* width, Game* game) {
+    // variables' names chosen to match the formula
+    int m, t;
+    if (game->height >= game->width) {
+        m = game->height;
+    } else {
+        m = game->width;
     }
-    stack->rowLog[stack->logCount] = row;
-    stack->columnLog[stack->logCount++] = column;
+    t = (game->players[0]->moveCounter * 9 % 1000037) + 17;
+    *height = (t / m) % game->height;
+    *width = t % game->width;
 
-    stack->rows[stack->count] = row;
-    stack->columns[(stack->count)++] = column;
-    return stack;
+    game->players[0]->moveCounter++;
 }
 
 /**
-    Removes the cell given by its row and column values from the stack
-    and returns the updated stack. Stack remains unchanged if empty.
+    Generates the automatic move for player X
 **/
-Stack* pop(Stack* stack, int* row, int* column) {
-    if (stack->count == 0) {
-        return stack;
+void get_auto_move_for_x(int* height, int* width, Game* game) {
+    // variables' names chosen to match the formula
+    int m, t;
+    if (game->height >= game->width) {
+        m = game->height;
+    } else {
+        m = game->width;
     }
-    *row = stack->rows[--(stack->count)];
-    *column = stack->columns[stack->count];
-    return stack;
+    t = (game->players[1]->moveCounter * 7 % 1000213) + 81;
+    *height = (t / m) % game->height;
+    *width = t % game->width;
+
+    game->players[1]->moveCounter++;
 }
 
 /**
-    Adds all the neighbours above the current cell to the stack.
-    The current cell is represented by the 'row' and 'column' parameters.
-    The updated stack is returned.
+    Writes the game to 'fileName'. The game is written to a temporary file
+    first and renamed into place, so an interrupted save never leaves a
+    truncated file behind. Returns false if the game could not be written.
 **/
-Stack* add_top_cells_to_stack(Stack* stack, int row, int column, 
-        Game* game, char value) {
-    if (column > 0) {
-        if (game->board[row][column - 1] == value) {
-            // left
-            stack = push(stack, row, column - 1);
-        }
-        if (row > 0) {
-            if (game->board[row - 1][column - 1] == value) {
-                // top-left
-                stack = push(stack, row - 1, column - 1);
-            }
+bool write_game_file(Game* game, const char* fileName) {
+    char* tempName = malloc(strlen(fileName) + 5);
+    sprintf(tempName, "%s.tmp", fileName);
+    FILE* outputFile = fopen(tempName, "w");
+    bool written = false;
+    if (outputFile != NULL) {
+        fprintf(outputFile, "%d,%d,%d,%d,%d\n", game->isXTurn, game->height,
+                game->width, game->players[0]->moveCounter,
+                game->players[1]->moveCounter);
+        for (int i = 0; i < game->height; i++) {
+            fwrite(game->board[i], 1, game->width, outputFile);
+            fprintf(outputFile, "\n");
         }
-    }
-    if (row > 0) {
-        if (game->board[row - 1][column] == value) {
-            // top-right
-            stack = push(stack, row - 1, column);
+        written = !ferror(outputFile);
+        written = fclose(outputFile) == 0 && written
+                && rename(tempName, fileName) == 0;
+        if (!written) {
+            remove(tempName);
         }
     }
-    if (column < game->width - 1) {
-        if (game->board[row][column + 1] == value) {
-            // right
-            stack = push(stack, row, column + 1);
-        }
+    free(tempName);
+    return written;
+}
+
+/**
+    Saves the game currently being played
+**/
+void save_game(Game* game, const char* fileName) {
+    if (!write_game_file(game, fileName)) {
+        printf("Unable to save game\n");
     }
-    return stack;
 }
 
 /**
-    Adds all the cells below the current cell to the stack and returns
-    the updated stack. The current cell is represented 
-    by the 'row' and 'column' parameters.
+    Finalizer from splitmix64, used to derive hash keys and random numbers
 **/
-Stack* add_bottom_cells_to_stack(Stack* stack, int row, int column,
-        Game* game, char value) {
-    if (column > 0) {
-        if (game->board[row][column - 1] == value) {
-            // left
-            stack = push(stack, row, column - 1);
-        }
+uint64_t mix64(uint64_t value) {
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+/**
+    Returns the next number from the pseudo random sequence given by 'state'
+**/
+uint64_t next_random(uint64_t* state) {
+    *state += 0x9e3779b97f4a7c15ULL;
+    return mix64(*state);
+}
+
+/**
+    Returns the hash of an empty board with the given dimensions. Books
+    built for other dimensions therefore never match.
+**/
+uint64_t board_key(int height, int width) {
+    return mix64(((uint64_t)height << 32) | (uint64_t)width);
+}
+
+/**
+    Returns the zobrist key of a stone 'value' at the given cell. Keys are
+    derived from the cell rather than from a random table so that every
+    process computes the same keys without any initialisation.
+**/
+uint64_t cell_key(int row, int column, char value) {
+    if (value != 'O' && value != 'X') {
+        return 0;
     }
-    if (row < game->height - 1) {
-        if (game->board[row + 1][column] == value) {
-            // bottom left
-            stack = push(stack, row + 1, column);
-        }
-        if (column < game->width - 1) {
-            if (game->board[row + 1][column + 1] == value) {
-                // bottom right
-                stack = push(stack, row + 1, column + 1);
-            }
-        }
+    uint64_t cell = ((uint64_t)row << 32) | (uint64_t)column;
+    return mix64(cell * 2 + (value == 'X') + 0x517cc1b727220a95ULL);
+}
+
+/**
+    Returns the key identifying the current position, including
+    the player to move
+**/
+uint64_t position_key(Game* game) {
+    return game->isXTurn ? ~game->hash : game->hash;
+}
+
+/**
+    Returns the winner of a filled board
+**/
+char find_winner(Game* game) {
+    return game->kernels->find_winner(game);
+}
+
+/**
+    Clears every stone from the board and gives the move back to O
+**/
+void reset_board(Game* game) {
+    for (int i = 0; i < game->height; i++) {
+        memset(game->board[i], '.', game->width);
     }
-    if (column < game->width - 1) {
-        if (game->board[row][column + 1] == value) {
-            // right
-            stack = push(stack, row, column + 1);
+    game->hash = board_key(game->height, game->width);
+    game->isXTurn = false;
+    game->winner = '.';
+}
+
+// the score of an untried move, and the weight of the exploration term
+#define BOOK_FIRST_PLAY 0.6
+#define BOOK_EXPLORATION 0.5
+
+/**
+    A position in the book tree, with the wins and visits of every move
+    tried from it during book generation
+**/
+typedef struct BookNode {
+    uint64_t key;
+    int depth;
+    uint32_t visits;
+    uint32_t* moveWins;
+    uint32_t* moveVisits;
+} BookNode;
+
+/**
+    The positions self-play has explored so far, indexed by position key
+**/
+typedef struct BookTree {
+    BookNode* nodes;
+    size_t nodeCount;
+    size_t nodeSize;
+    int32_t* slots;
+    size_t slotMask;
+    int cells;
+} BookTree;
+
+/**
+    Returns the node for 'key', or NULL if the tree has not reached it
+**/
+BookNode* find_book_node(BookTree* tree, uint64_t key) {
+    for (size_t slot = mix64(key) & tree->slotMask;
+            tree->slots[slot] >= 0; slot = (slot + 1) & tree->slotMask) {
+        if (tree->nodes[tree->slots[slot]].key == key) {
+            return &tree->nodes[tree->slots[slot]];
         }
     }
-    return stack;
+    return NULL;
 }
 
 /**
-    Adds all the neighbours left of the current cell to the stack and
-    returns the updated stack. The current cell
-    is represented by the 'row' and 'column' parameters.
+    Adds a node for 'key' at 'depth' plies into the game.
+    Returns false if there is no memory left for it.
 **/
-Stack* add_left_cells_to_stack(Stack* stack, int row, int column,
-        Game* game, char value) {
-    if (column > 0) {
-        if (game->board[row][column - 1] == value) {
-            // left
-            stack = push(stack, row, column - 1);
+bool add_book_node(BookTree* tree, uint64_t key, int depth) {
+    if (tree->nodeCount == tree->nodeSize) {
+        BookNode* nodes = realloc(tree->nodes,
+                sizeof(BookNode) * tree->nodeSize * 2);
+        if (nodes == NULL) {
+            return false;
         }
+        tree->nodes = nodes;
+        tree->nodeSize *= 2;
     }
-    if (row > 0 && column > 0) {
-        if (game->board[row - 1][column - 1] == value) {
-            // top left
-            stack = push(stack, row - 1, column - 1);
+    if (2 * (tree->nodeCount + 1) > tree->slotMask + 1) {
+        size_t slotCount = (tree->slotMask + 1) * 2;
+        int32_t* slots = malloc(sizeof(int32_t) * slotCount);
+        if (slots == NULL) {
+            return false;
+        }
+        memset(slots, -1, sizeof(int32_t) * slotCount);
+        free(tree->slots);
+        tree->slots = slots;
+        tree->slotMask = slotCount - 1;
+        for (size_t i = 0; i < tree->nodeCount; i++) {
+            size_t slot = mix64(tree->nodes[i].key) & tree->slotMask;
+            while (slots[slot] >= 0) {
+                slot = (slot + 1) & tree->slotMask;
+            }
+            slots[slot] = i;
         }
     }
-    if ((row < game->height - 1) && game->board[row + 1][column] == value) {
-        // bottom left
-        stack = push(stack, row + 1, column);
+    uint32_t* counts = calloc(2 * tree->cells, sizeof(uint32_t));
+    if (counts == NULL) {
+        return false;
+    }
+    BookNode* node = &tree->nodes[tree->nodeCount];
+    node->key = key;
+    node->depth = depth;
+    node->visits = 0;
+    node->moveWins = counts;
+    node->moveVisits = counts + tree->cells;
+    size_t slot = mix64(key) & tree->slotMask;
+    while (tree->slots[slot] >= 0) {
+        slot = (slot + 1) & tree->slotMask;
     }
-    return stack;
+    tree->slots[slot] = tree->nodeCount++;
+    return true;
 }
 
 /**
-    Adds all the neighbours right of the current cell to the stack and
-    returns the updated stack. The current cell is represented by the
-    'row' and 'column' parameters.
+    Picks the move to try from 'node' with the best upper confidence
+    bound. Untried moves score BOOK_FIRST_PLAY, so a move that keeps
+    winning is followed deeper before every alternative has been tried.
 **/
-Stack* add_right_cells_to_stack(Stack* stack, int row, int column,
-        Game* game, char value) {
-    if (column < game->width - 1) {
-        if (game->board[row][column + 1] == value) {
-            // right
-            stack = push(stack, row, column + 1);
+int select_book_move(BookNode* node, Game* game, uint64_t* seed) {
+    int best = -1, ties = 0;
+    double bestScore = -1;
+    for (int cell = 0; cell < game->height * game->width; cell++) {
+        if (game->board[cell / game->width][cell % game->width] != '.') {
+            continue;
         }
-    }
-    if (row > 0) {
-        if (game->board[row - 1][column] == value) {
-            // top right
-            stack = push(stack, row - 1, column);
+        uint32_t visits = node->moveVisits[cell];
+        double score = BOOK_FIRST_PLAY;
+        if (visits > 0) {
+            score = (double)node->moveWins[cell] / visits + BOOK_EXPLORATION
+                    * sqrt(log(node->visits) / visits);
         }
-    }
-    if (row < game->height - 1 && column < game->width - 1) {
-        if (game->board[row + 1][column + 1] == value) {
-            // bottom right
-            stack = push(stack, row + 1, column + 1);
+        if (score > bestScore) {
+            best = cell;
+            bestScore = score;
+            ties = 1;
+        } else if (score == bestScore
+                && next_random(seed) % (uint64_t)++ties == 0) {
+            best = cell;
         }
     }
-    return stack;
+    return best;
 }
 
 /**
-    Returns true if the 'stack.pop()' element is connected to the
-    top of the board, and false otherwise.
+    Orders book entries by position key
 **/
-bool check_top(Stack* stack, char value, Game* game) {
-    while (stack->count > 0) {
-        int row = -1, column = -1;
-        stack = pop(stack, &row, &column);
-        if (row == 0 && game->board[row][column] == value) {
-            return true;
-        }
-        stack = add_top_cells_to_stack(stack, row, column, game, value);
+int compare_book_entries(const void* first, const void* second) {
+    const BookEntry* a = first;
+    const BookEntry* b = second;
+    if (a->key != b->key) {
+        return a->key < b->key ? -1 : 1;
     }
-    return false;
+    return 0;
 }
 
 /**
-    Returns true if the 'stack.pop()' element is connected to the
-    bottom of the board, and false otherwise.
+    Returns the offset of the first book entry from the start of the file
 **/
-bool check_bottom(Stack* stack, char value, Game* game) {
-    while (stack->count > 0) {
-        int row = -1, column = -1;
-        stack = pop(stack, &row, &column);
-        if ((row == game->height - 1) && game->board[row][column] == value) {
-            return true;
-        }
-        stack = add_bottom_cells_to_stack(stack, row, column, game, value);
-    }
-    return false;
+size_t book_entries_offset(uint32_t bucketBits) {
+    size_t offset = sizeof(BookHeader)
+            + sizeof(uint32_t) * (((size_t)1 << bucketBits) + 1);
+    return (offset + 7) & ~(size_t)7;
 }
 
 /**
-    Returns true if the 'stack.pop()' element is connected to the
-    left of the board, and false otherwise.
+    Plays 'games' self-play games, choosing the first 'plies' moves from
+    the tree of positions explored so far and the rest at random. A
+    position joins the tree once the move leading to it has been tried
+    'minVisits' times, so the games go deeper along the strongest lines
+    instead of spreading evenly over every opening.
 **/
-bool check_left(Stack* stack, char value, Game* game) {
-    while (stack->count > 0) {
-        int row = -1, column = -1;
-        stack = pop(stack, &row, &column);
-        if (column == 0 && game->board[row][column] == value) {
-            return true;
+void play_book_games(BookTree* tree, Game* game, int games, int plies,
+        int minVisits, int* order, BookNode** path, int* moves) {
+    uint64_t seed = 0x4845584245414bULL;
+    bool growing = true;
+    for (int g = 0; g < games; g++) {
+        reset_board(game);
+        BookNode* node = &tree->nodes[0];
+        int pathCount = 0;
+        while (node != NULL && pathCount < plies && pathCount < tree->cells) {
+            int cell = select_book_move(node, game, &seed);
+            int row = cell / game->width;
+            int column = cell % game->width;
+            char value = game->isXTurn ? 'X' : 'O';
+            path[pathCount] = node;
+            moves[pathCount++] = cell;
+            game->board[row][column] = value;
+            game->hash ^= cell_key(row, column, value);
+            game->isXTurn = !game->isXTurn;
+            node = find_book_node(tree, position_key(game));
+        }
+        uint64_t leafKey = position_key(game);
+
+        // a filled board always has exactly one winner
+        int empty = 0;
+        for (int cell = 0; cell < tree->cells; cell++) {
+            if (game->board[cell / game->width][cell % game->width] == '.') {
+                order[empty++] = cell;
+            }
+        }
+        for (int i = empty - 1; i > 0; i--) {
+            int j = (int)(next_random(&seed) % (uint64_t)(i + 1));
+            int swap = order[i];
+            order[i] = order[j];
+            order[j] = swap;
+        }
+        for (int i = 0; i < empty; i++) {
+            game->board[order[i] / game->width][order[i] % game->width]
+                    = game->isXTurn ? 'X' : 'O';
+            game->isXTurn = !game->isXTurn;
+        }
+        char winner = find_winner(game);
+        for (int i = 0; i < pathCount; i++) {
+            path[i]->visits++;
+            path[i]->moveVisits[moves[i]]++;
+            path[i]->moveWins[moves[i]] += winner == (i % 2 ? 'X' : 'O');
+        }
+        // running out of memory only stops the tree from growing
+        if (growing && node == NULL && pathCount < plies
+                && pathCount < tree->cells
+                && path[pathCount - 1]->moveVisits[moves[pathCount - 1]]
+                    >= (uint32_t)minVisits) {
+            growing = add_book_node(tree, leafKey, pathCount);
         }
-        stack = add_left_cells_to_stack(stack, row, column, game, value);
     }
-    return false;
 }
 
 /**
-    Returns true if the 'stack.pop()' element is connected to the
-    right of the board, and false otherwise.
+    Records for every position in the tree its most tried move among
+    those tried at least 'minVisits' times. Positions where that move's
+    smoothed win rate is not above one half are left out, so the book
+    only answers when the games favour its move.
+    Returns the number of entries, sorted by key, and stores in 'depth'
+    the number of plies the book covers.
 **/
-bool check_right(Stack* stack, char value, Game* game) {
-    while (stack->count > 0) {
-        int row = -1, column = 1;
-        stack = pop(stack, &row, &column);
-        if (column == game->width - 1 && game->board[row][column] == value) {
-            return true;
+size_t collect_book_entries(BookTree* tree, int width, int minVisits,
+        BookEntry* entries, int* depth) {
+    size_t entryCount = 0;
+    *depth = 0;
+    for (size_t n = 0; n < tree->nodeCount; n++) {
+        BookNode* node = &tree->nodes[n];
+        BookEntry* entry = &entries[entryCount];
+        memset(entry, 0, sizeof(BookEntry));
+        entry->key = node->key;
+        for (int cell = 0; cell < tree->cells; cell++) {
+            uint32_t visits = node->moveVisits[cell];
+            if (visits >= (uint32_t)minVisits && visits > entry->visits) {
+                entry->row = cell / width;
+                entry->column = cell % width;
+                entry->wins = node->moveWins[cell];
+                entry->visits = visits;
+            }
+        }
+        if (entry->visits > 0 && 2 * ((uint64_t)entry->wins + 1)
+                > (uint64_t)entry->visits + 2) {
+            entryCount++;
+            if (node->depth + 1 > *depth) {
+                *depth = node->depth + 1;
+            }
         }
-        stack = add_right_cells_to_stack(stack, row, column, game, value);
     }
-    return false;
+    qsort(entries, entryCount, sizeof(BookEntry), compare_book_entries);
+    return entryCount;
 }
 
 /**
-    Checks the game over conditions after every move and returns true if the
-    game is over.
+    Builds the book entries for 'game' into a new array.
+    Returns NULL if out of memory.
 **/
-bool check_game_over(int row, int column, char value, Game* game) {
-    Stack* stack = initialize_stack(game);
-    stack = push(stack, row, column);
-    // player X, checks for top-bottom connection
-    if (value == 'X') {
-        if (check_top(stack, value, game)) {
-            stack->count = 0;
-            stack->logCount = 0;
-            stack = push(stack, row, column);
-            if(check_bottom(stack, value, game)) {
-                game->winner = value;
-                return true;
-            }
+BookEntry* generate_book_entries(Game* game, int games, int plies,
+        int minVisits, size_t* entryCount, int* depth) {
+    BookTree tree;
+    tree.cells = game->height * game->width;
+    tree.nodeCount = 0;
+    tree.nodeSize = 64;
+    tree.nodes = malloc(sizeof(BookNode) * tree.nodeSize);
+    tree.slotMask = 127;
+    tree.slots = malloc(sizeof(int32_t) * (tree.slotMask + 1));
+    int* order = malloc(sizeof(int) * tree.cells);
+    BookNode** path = malloc(sizeof(BookNode*) * plies);
+    int* moves = malloc(sizeof(int) * plies);
+    BookEntry* entries = NULL;
+    if (tree.nodes != NULL && tree.slots != NULL && order != NULL
+            && path != NULL && moves != NULL) {
+        memset(tree.slots, -1, sizeof(int32_t) * (tree.slotMask + 1));
+        reset_board(game);
+        if (add_book_node(&tree, position_key(game), 0)) {
+            play_book_games(&tree, game, games, plies, minVisits, order,
+                    path, moves);
+            entries = malloc(sizeof(BookEntry) * tree.nodeCount);
         }
-    } else { // player O, checks for left-right connection
-        if (check_left(stack, value, game)) {
-            stack->count = 0;
-            stack->logCount = 0;
-            stack = push(stack, row, column);
-            if (check_right(stack, value, game)) {
-                game->winner = value;
-                return true;
-            }
+        if (entries != NULL) {
+            *entryCount = collect_book_entries(&tree, game->width,
+                    minVisits, entries, depth);
         }
     }
-    free_stack(stack);
-    return false;
+    for (size_t n = 0; n < tree.nodeCount; n++) {
+        free(tree.nodes[n].moveWins);
+    }
+    free(tree.nodes);
+    free(tree.slots);
+    free(order);
+    free(path);
+    free(moves);
+    return entries;
 }
 
 /**
-    Returns true if the move currently generated or 
-    obtained from stdin is valid.
+    Builds an opening book for boards of the given dimensions and writes
+    it to 'fileName'. The book is written to a temporary file first and
+    renamed into place, so processes mapping the old book are unaffected.
 **/
-bool is_move_valid(int height, int width, Game* game) {
-    if (height >= game->height || width >= game->width) {
-        return false;
+int build_book(const char* fileName, int height, int width, int games,
+        int plies, int minVisits) {
+    Game* game = initialize_game(height, width);
+    size_t entryCount = 0;
+    int depth = 0;
+    BookEntry* entries = generate_book_entries(game, games, plies, minVisits,
+            &entryCount, &depth);
+    free_game(game);
+    if (entries == NULL) {
+        return -1;
     }
-    if (height < 0 || width < 0) {
-        return false;
+
+    BookHeader header;
+    memset(&header, 0, sizeof(BookHeader));
+    memcpy(header.magic, "HEXBOOK1", sizeof(header.magic));
+    header.height = height;
+    header.width = width;
+    header.entryCount = entryCount;
+    header.bucketBits = 1;
+    while (header.bucketBits < 30
+            && ((size_t)1 << header.bucketBits) < entryCount) {
+        header.bucketBits++;
     }
-    if (game->board[height][width] != '.') {
-        return false;
+    size_t bucketCount = ((size_t)1 << header.bucketBits) + 1;
+    uint32_t* buckets = malloc(sizeof(uint32_t) * bucketCount);
+    size_t index = 0;
+    for (size_t b = 0; b < bucketCount - 1; b++) {
+        while (index < entryCount
+                && (entries[index].key >> (64 - header.bucketBits)) < b) {
+            index++;
+        }
+        buckets[b] = index;
     }
-    return true;
+    buckets[bucketCount - 1] = entryCount;
+
+    char* tempName = malloc(strlen(fileName) + 5);
+    sprintf(tempName, "%s.tmp", fileName);
+    FILE* bookFile = fopen(tempName, "wb");
+    int result = -1;
+    if (bookFile != NULL) {
+        static const char padding[8] = {0};
+        size_t used = sizeof(BookHeader) + sizeof(uint32_t) * bucketCount;
+        bool written = fwrite(&header, sizeof(BookHeader), 1, bookFile) == 1
+                && fwrite(buckets, sizeof(uint32_t), bucketCount, bookFile)
+                    == bucketCount
+                && fwrite(padding, 1, book_entries_offset(header.bucketBits)
+                    - used, bookFile) == book_entries_offset(header.bucketBits)
+                    - used
+                && fwrite(entries, sizeof(BookEntry), entryCount, bookFile)
+                    == entryCount;
+        if (fclose(bookFile) == 0 && written
+                && rename(tempName, fileName) == 0) {
+            printf("Wrote %zu positions to %s, covering %d plies\n",
+                    entryCount, fileName, depth);
+            if (depth < plies) {
+                fprintf(stderr, "Only %d of %d plies were filled, play more "
+                        "games or lower minVisits\n", depth, plies);
+            }
+            result = 0;
+        } else {
+            remove(tempName);
+        }
+    }
+    free(tempName);
+    free(buckets);
+    free(entries);
+    return result;
 }
 
 /**
-    Generates the automatic move for player O
+    Parses 'text' as a number between 'min' and 'max' inclusive.
+    Returns -1 if it is not one.
 **/
-void get_auto_move_for_o(int* height, int* width, Game* game) {
-    // variables' names chosen to match the formula
-    int m, t;
-    if (game->height >= game->width) {
-        m = game->height;
-    } else {
-        m = game->width;
+int parse_number(const char* text, int min, int max) {
+    char* error = 0;
+    long value = strtol(text, &error, 10);
+    if (*text == '\0' || *error != '\0' || value < min || value > max) {
+        return -1;
     }
-    t = (game->players[0]->moveCounter * 9 % 1000037) + 17;
-    *height = (t / m) % game->height;
-    *width = t % game->width;
-
-    game->players[0]->moveCounter++;
+    return (int)value;
 }
 
 /**
-    Generates the automatic move for player X
+    Handles 'hex book bookfile height width [games plies [minVisits]]'
 **/
-void get_auto_move_for_x(int* height, int* width, Game* game) {
-    // variables' names chosen to match the formula
-    int m, t;
-    if (game->height >= game->width) {
-        m = game->height;
-    } else {
-        m = game->width;
+int build_book_command(int argc, char** argv) {
+    if (argc != 5 && argc != 7 && argc != 8) {
+        return show_error_message(BOOK_USAGE);
     }
-    t = (game->players[1]->moveCounter * 7 % 1000213) + 81;
-    *height = (t / m) % game->height;
-    *width = t % game->width;
-
-    game->players[1]->moveCounter++;
+    int height = parse_number(argv[3], 1, 1000);
+    int width = parse_number(argv[4], 1, 1000);
+    if (height < 0 || width < 0) {
+        return show_error_message(GRID_DIMENSIONS);
+    }
+    int games = 100000, plies = 4, minVisits = 10;
+    if (argc >= 7) {
+        games = parse_number(argv[5], 1, 10000000);
+        plies = parse_number(argv[6], 1, 16);
+        minVisits = (argc == 8) ? parse_number(argv[7], 1, 10000000) : 10;
+        if (games < 0 || plies < 0 || minVisits < 0) {
+            return show_error_message(BOOK_USAGE);
+        }
+    }
+    if (build_book(argv[2], height, width, games, plies, minVisits) < 0) {
+        return show_error_message(BOOK_WRITE);
+    }
+    return 0;
 }
 
 /**
-    Saves the game currently being played
+    Maps the opening book in 'fileName' read-only into memory. Nothing is
+    parsed or copied, so the pages are shared between every process using
+    the same book. Returns NULL if the book is missing, corrupt or was
+    built for a board of different dimensions.
 **/
-void save_game(Game* game, char* fileName) {
-    FILE* outputFile = fopen(fileName + 1, "w");
-    if (outputFile == NULL) {
-        printf("Unable to save game\n");
-        return;
-    } else {
-        fprintf(outputFile, "%d,%d,%d,%d,%d\n", game->isXTurn, game->height,
-                game->width, game->players[0]->moveCounter,
-                game->players[1]->moveCounter);
+Book* load_book(const char* fileName, Game* game) {
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(BookHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t mapSize = info.st_size;
+    void* map = mmap(NULL, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    const BookHeader* header = map;
+    if (memcmp(header->magic, "HEXBOOK1", sizeof(header->magic)) != 0
+            || header->height != (uint32_t)game->height
+            || header->width != (uint32_t)game->width
+            || header->bucketBits < 1 || header->bucketBits > 30
+            || mapSize < book_entries_offset(header->bucketBits)
+                + sizeof(BookEntry) * (size_t)header->entryCount) {
+        munmap(map, mapSize);
+        return NULL;
+    }
+    Book* book = malloc(sizeof(Book));
+    book->map = map;
+    book->mapSize = mapSize;
+    book->header = header;
+    book->buckets = (const uint32_t*)(header + 1);
+    book->entries = (const BookEntry*)((const char*)map
+            + book_entries_offset(header->bucketBits));
+    // lookups trust the directory, so every offset must be in order and
+    // within the entries, with the last one closing the array
+    size_t bucketCount = ((size_t)1 << header->bucketBits) + 1;
+    for (size_t b = 1; b < bucketCount; b++) {
+        if (book->buckets[b] < book->buckets[b - 1]
+                || book->buckets[b] > header->entryCount) {
+            free_book(book);
+            return NULL;
+        }
+    }
+    if (book->buckets[bucketCount - 1] != header->entryCount) {
+        free_book(book);
+        return NULL;
+    }
+    return book;
+}
+
+/**
+    Looks up the current position in the book. Returns true and sets
+    'height' and 'width' to the book move if the position is known.
+**/
+bool get_book_move(Book* book, Game* game, int* height, int* width) {
+    if (book == NULL) {
+        return false;
+    }
+    uint64_t key = position_key(game);
+    uint64_t bucket = key >> (64 - book->header->bucketBits);
+    uint32_t end = book->buckets[bucket + 1];
+    for (uint32_t i = book->buckets[bucket]; i < end; i++) {
+        const BookEntry* entry = &book->entries[i];
+        if (entry->key > key) {
+            break;
+        }
+        if (entry->key == key
+                && is_move_valid(entry->row, entry->column, game)) {
+            *height = entry->row;
+            *width = entry->column;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+    Plays random moves until the game is over and returns the winner
+**/
+char playout(Game* game, uint64_t* seed) {
+    return game->kernels->playout(game, seed);
+}
+
+/**
+    Largest padded board handled by the fixed size kernels
+**/
+#define FIXED_CELLS (21 * 21)
+
+/*
+    The padded_* functions below work on the padded board in 'game->cells',
+    whose '#' border means neighbours never need bounds checks. They take
+    the board size as parameters and are always inlined: the generic
+    kernels pass the game's dimensions and its scratch buffers, while the
+    fixed size kernels pass constants, so the compiler can fold the
+    stride, unroll the neighbour loops and size every buffer statically.
+    Both run the same flood fill, so any speedup comes from specialising.
+*/
+
+/**
+    Flood fills the stones given by 'value' from the 'count' cells already
+    on 'stack', and returns which walls were reached: bit 0 for the top
+    (X) or left (O) wall, bit 1 for the bottom or right wall.
+**/
+static inline __attribute__((always_inline)) int padded_flood(
+        const int height, const int width, const char* cells,
+        unsigned char* visited, int* stack, int count, char value) {
+    const int s = width + 2;
+    const int offsets[6] = {-1, 1, -s - 1, -s, s, s + 1};
+    const int last = (value == 'X') ? height - 1 : width - 1;
+    int walls = 0;
+    while (count > 0 && walls != 3) {
+        int cell = stack[--count];
+        int line = (value == 'X') ? cell / s - 1 : cell % s - 1;
+        walls |= (line == 0) | ((line == last) << 1);
+        for (int i = 0; i < 6; i++) {
+            int next = cell + offsets[i];
+            if (cells[next] == value && !visited[next]) {
+                visited[next] = 1;
+                stack[count++] = next;
+            }
+        }
+    }
+    return walls;
+}
+
+/**
+    Returns true if the stones given by 'value' connect their walls
+**/
+static inline __attribute__((always_inline)) bool padded_connected(
+        const int height, const int width, const char* cells,
+        unsigned char* visited, int* stack, char value) {
+    const int s = width + 2;
+    const int starts = (value == 'X') ? width : height;
+    int count = 0;
+    memset(visited, 0, s * (height + 2));
+    for (int i = 0; i < starts; i++) {
+        int cell = (value == 'X') ? s + 1 + i : (i + 1) * s + 1;
+        if (cells[cell] == value) {
+            visited[cell] = 1;
+            stack[count++] = cell;
+        }
+    }
+    return padded_flood(height, width, cells, visited, stack, count,
+            value) == 3;
+}
+
+static inline __attribute__((always_inline)) bool padded_check_game_over(
+        const int height, const int width, int row, int column, char value,
+        Game* game, unsigned char* visited, int* stack) {
+    const int s = width + 2;
+    memset(visited, 0, s * (height + 2));
+    stack[0] = (row + 1) * s + column + 1;
+    visited[stack[0]] = 1;
+    if (padded_flood(height, width, game->cells, visited, stack, 1, value)
+            == 3) {
+        game->winner = value;
+        return true;
+    }
+    return false;
+}
+
+static inline __attribute__((always_inline)) char padded_find_winner(
+        const int height, const int width, Game* game,
+        unsigned char* visited, int* stack) {
+    if (padded_connected(height, width, game->cells, visited, stack, 'X')) {
+        return 'X';
+    }
+    if (padded_connected(height, width, game->cells, visited, stack, 'O')) {
+        return 'O';
+    }
+    return '.';
+}
+
+/**
+    Plays the game out on a copy of the board in 'cells'. 'stack' holds
+    the empty cells first and the flood fill afterwards.
+**/
+static inline __attribute__((always_inline)) char padded_playout(
+        const int height, const int width, Game* game, uint64_t* seed,
+        char* cells, unsigned char* visited, int* stack) {
+    const int s = width + 2;
+    int count = 0;
+    memcpy(cells, game->cells, s * (height + 2));
+    for (int i = s + 1; i < s * (height + 1); i++) {
+        if (cells[i] == '.') {
+            stack[count++] = i;
+        }
+    }
+    char value = game->isXTurn ? 'X' : 'O';
+    for (int i = count; i > 0; i--) {
+        int j = (int)(next_random(seed) % (uint64_t)i);
+        cells[stack[j]] = value;
+        stack[j] = stack[i - 1];
+        value = (value == 'X') ? 'O' : 'X';
+    }
+    // a filled board always has exactly one winner
+    return padded_connected(height, width, cells, visited, stack, 'X')
+            ? 'X' : 'O';
+}
+
+/**
+    Renders the whole board into 'frame' and writes it with a single call
+**/
+static inline __attribute__((always_inline)) void padded_print_game(
+        const int height, const int width, Game* game, char* frame) {
+    const int s = width + 2;
+    int length = 0;
+    for (int i = 0; i < height; i++) {
+        const char* row = game->cells + (i + 1) * s + 1;
+        memset(frame + length, ' ', height - 1 - i);
+        length += height - 1 - i;
+        for (int j = 0; j < width; j++) {
+            frame[length++] = row[j];
+            frame[length++] = ' ';
+        }
+        frame[length - 1] = '\n';
+    }
+    fwrite(frame, 1, length, stdout);
+}
+
+/**
+    Checks the game over conditions on a board of any size
+**/
+bool check_game_over_generic(int row, int column, char value, Game* game) {
+    return padded_check_game_over(game->height, game->width, row, column,
+            value, game, game->visited, game->flood);
+}
+
+/**
+    Returns the winner of a board of any size, or '.' if neither player
+    has connected their walls yet
+**/
+char find_winner_generic(Game* game) {
+    return padded_find_winner(game->height, game->width, game,
+            game->visited, game->flood);
+}
+
+/**
+    Plays random moves on a board of any size until it is filled and
+    returns the winner, without changing the board
+**/
+char playout_generic(Game* game, uint64_t* seed) {
+    return padded_playout(game->height, game->width, game, seed,
+            game->scratch, game->visited, game->flood);
+}
+
+/**
+    Prints the game board of any size. The frame buffer is only allocated
+    once the game is first printed.
+**/
+void print_game_generic(Game* game) {
+    if (game->frame == NULL) {
+        game->frame = malloc(sizeof(char) * game->height
+                * (game->height + 2 * game->width));
+    }
+    padded_print_game(game->height, game->width, game, game->frame);
+}
+
+const Kernels genericKernels = {
+    "generic",
+    is_move_valid_generic,
+    check_game_over_generic,
+    find_winner_generic,
+    playout_generic,
+    print_game_generic
+};
+
+/**
+    Defines the kernels for an n x n board, named 'kernels<n>'
+**/
+#define DEFINE_FIXED_KERNELS(n) \
+    bool is_move_valid_##n(int height, int width, Game* game) { \
+        return (unsigned)height < (unsigned)n \
+                && (unsigned)width < (unsigned)n \
+                && game->cells[(height + 1) * (n + 2) + width + 1] == '.'; \
+    } \
+    bool check_game_over_##n(int row, int column, char value, Game* game) { \
+        unsigned char visited[FIXED_CELLS]; \
+        int stack[FIXED_CELLS]; \
+        return padded_check_game_over(n, n, row, column, value, game, \
+                visited, stack); \
+    } \
+    char find_winner_##n(Game* game) { \
+        unsigned char visited[FIXED_CELLS]; \
+        int stack[FIXED_CELLS]; \
+        return padded_find_winner(n, n, game, visited, stack); \
+    } \
+    char playout_##n(Game* game, uint64_t* seed) { \
+        char cells[FIXED_CELLS]; \
+        unsigned char visited[FIXED_CELLS]; \
+        int stack[FIXED_CELLS]; \
+        return padded_playout(n, n, game, seed, cells, visited, stack); \
+    } \
+    void print_game_##n(Game* game) { \
+        char frame[n * 3 * n]; \
+        padded_print_game(n, n, game, frame); \
+    } \
+    const Kernels kernels##n = { \
+        #n "x" #n, \
+        is_move_valid_##n, \
+        check_game_over_##n, \
+        find_winner_##n, \
+        playout_##n, \
+        print_game_##n \
+    };
+
+DEFINE_FIXED_KERNELS(11)
+DEFINE_FIXED_KERNELS(13)
+DEFINE_FIXED_KERNELS(19)
+
+/**
+    Returns the kernels for a board of the given dimensions: the
+    specialised ones for the standard sizes, the generic ones otherwise.
+**/
+const Kernels* select_kernels(int height, int width) {
+    if (height == width) {
+        switch (height) {
+            case 11:
+                return &kernels11;
+            case 13:
+                return &kernels13;
+            case 19:
+                return &kernels19;
+        }
+    }
+    return &genericKernels;
+}
+
+/**
+    Returns the number of seconds elapsed since 'start'
+**/
+double seconds_since(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec)
+            + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+    Times 'iterations' playouts, game over checks and board renders with
+    the given kernels, and stores the rate of each in 'rates'
+**/
+void bench_kernels(const Kernels* kernels, Game* game, int iterations,
+        double rates[3]) {
+    struct timespec start;
+    uint64_t seed = 1;
+    int cells = game->height * game->width;
+    int winners = 0;
+    game->kernels = kernels;
+    reset_board(game);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        winners += (playout(game, &seed) == 'X');
+    }
+    rates[0] = iterations / seconds_since(&start);
+
+    // fill the board with random stones, then check a game over from
+    // every cell in turn
+    for (int i = 0; i < cells; i++) {
+        game->board[i / game->width][i % game->width] =
+                (next_random(&seed) & 1) ? 'X' : 'O';
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        int cell = i % cells;
+        int row = cell / game->width, column = cell % game->width;
+        winners += check_game_over(row, column, game->board[row][column],
+                game);
+    }
+    rates[1] = iterations / seconds_since(&start);
+
+    fflush(stdout);
+    int savedStdout = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        print_game(game);
+    }
+    fflush(stdout);
+    rates[2] = iterations / seconds_since(&start);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(devNull);
+    close(savedStdout);
+    // keeps the compiler from discarding the playouts and checks
+    if (winners < 0) {
+        printf("%d\n", winners);
+    }
+}
+
+/**
+    Fills 'boards' random boards, from nearly empty to full, and returns
+    true if the generic and 'selected' kernels find the same winner on each
+    of them, give the same game over result from every stone and play out
+    the same random games
+**/
+bool kernels_agree(const Kernels* selected, Game* game, int boards) {
+    uint64_t seed = 2;
+    bool agree = true;
+    for (int b = 0; b < boards && agree; b++) {
+        // percentage of cells holding a stone
+        int density = 10 + b % 91;
         for (int i = 0; i < game->height; i++) {
             for (int j = 0; j < game->width; j++) {
-                fprintf(outputFile, "%c", game->board[i][j]);
+                uint64_t random = next_random(&seed);
+                game->board[i][j] = (int)(random % 100) >= density ? '.'
+                        : (random & 128) ? 'X' : 'O';
             }
-            fprintf(outputFile, "\n");
         }
+        agree = genericKernels.find_winner(game) == selected->find_winner(game);
+        for (int i = 0; i < game->height * game->width && agree; i++) {
+            int row = i / game->width, column = i % game->width;
+            char value = game->board[row][column];
+            if (value != '.') {
+                agree = genericKernels.check_game_over(row, column, value, game)
+                        == selected->check_game_over(row, column, value, game);
+            }
+        }
+        uint64_t genericSeed = seed, selectedSeed = seed;
+        agree = agree && genericKernels.playout(game, &genericSeed)
+                == selected->playout(game, &selectedSeed);
+    }
+    reset_board(game);
+    return agree;
+}
+
+/**
+    Handles 'hex bench height width [iterations]'. Compares the generic
+    kernels against the ones selected for the board size.
+**/
+int bench_command(int argc, char** argv) {
+    if (argc != 4 && argc != 5) {
+        return show_error_message(BENCH_USAGE);
+    }
+    int height = parse_number(argv[2], 1, 1000);
+    int width = parse_number(argv[3], 1, 1000);
+    if (height < 0 || width < 0) {
+        return show_error_message(GRID_DIMENSIONS);
+    }
+    int iterations = (argc == 5) ? parse_number(argv[4], 1, 100000000) : 20000;
+    if (iterations < 0) {
+        return show_error_message(BENCH_USAGE);
+    }
+    Game* game = initialize_game(height, width);
+    const Kernels* selected = game->kernels;
+    if (selected != &genericKernels && !kernels_agree(selected, game, 1000)) {
+        free_game(game);
+        return show_error_message(KERNEL_MISMATCH);
+    }
+    double generic[3], specialised[3];
+    bench_kernels(&genericKernels, game, iterations, generic);
+    printf("%-10s %14s %14s %14s\n", "kernels", "playouts/s", "checks/s",
+            "frames/s");
+    printf("%-10s %14.0f %14.0f %14.0f\n", genericKernels.name, generic[0],
+            generic[1], generic[2]);
+    if (selected != &genericKernels) {
+        bench_kernels(selected, game, iterations, specialised);
+        printf("%-10s %14.0f %14.0f %14.0f\n", selected->name,
+                specialised[0], specialised[1], specialised[2]);
+        printf("%-10s %13.2fx %13.2fx %13.2fx\n", "speedup",
+                specialised[0] / generic[0], specialised[1] / generic[1],
+                specialised[2] / generic[2]);
+    }
+    free_game(game);
+    return 0;
+}
+
+/**
+    Number of frames between autosaves
+**/
+#define AUTOSAVE_INTERVAL 10
+
+/**
+    Returns true if the thing 'reason' waits for has happened
+**/
+bool is_writer_ready(Writer* writer, WaitReason reason) {
+    size_t head = __atomic_load_n(&writer->head, __ATOMIC_SEQ_CST);
+    size_t tail = __atomic_load_n(&writer->tail, __ATOMIC_SEQ_CST);
+    switch (reason) {
+        case WAIT_ITEMS:
+            return head != tail;
+        case WAIT_SPACE:
+            return head - tail < WRITER_CAPACITY;
+        case WAIT_DRAINED:
+            return head == tail;
+    }
+    return true;
+}
+
+/**
+    Sleeps until the thing 'reason' waits for has happened. The sleeper
+    count is raised before checking, so a thread that moves 'head' or
+    'tail' afterwards always sees it and wakes the sleeper.
+**/
+void wait_for_writer(Writer* writer, WaitReason reason) {
+    if (is_writer_ready(writer, reason)) {
+        return;
+    }
+    pthread_mutex_lock(&writer->lock);
+    __atomic_add_fetch(&writer->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (!is_writer_ready(writer, reason)) {
+        pthread_cond_wait(&writer->changed, &writer->lock);
+    }
+    __atomic_sub_fetch(&writer->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/**
+    Wakes any thread sleeping on the writer after 'head' or 'tail' moved
+**/
+void wake_writer_sleepers(Writer* writer) {
+    if (__atomic_load_n(&writer->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&writer->lock);
+        pthread_cond_broadcast(&writer->changed);
+        pthread_mutex_unlock(&writer->lock);
+    }
+}
+
+/**
+    Saves the writer's copy of the game to the autosave file. A failure is
+    reported on stderr, once, so it never ends up among the board frames.
+**/
+void autosave_game(Writer* writer) {
+    if (!write_game_file(writer->game, writer->autosaveName)
+            && !writer->autosaveFailed) {
+        fprintf(stderr, "Unable to autosave game to %s\n",
+                writer->autosaveName);
+        writer->autosaveFailed = true;
+    }
+}
+
+/**
+    Renders, prints and autosaves the items published by the game thread,
+    in order, until it reaches the stop item
+**/
+void* run_writer(void* argument) {
+    Writer* writer = argument;
+    size_t tail = 0;
+    int framesSinceSave = 0;
+    bool running = true;
+    while (running) {
+        wait_for_writer(writer, WAIT_ITEMS);
+        WriterItem* item = &writer->items[tail % WRITER_CAPACITY];
+        switch (item->type) {
+            case ITEM_MOVE:
+                writer->game->board[item->row][item->column] = item->value;
+                break;
+            case ITEM_FRAME:
+                writer->game->isXTurn = item->isXTurn;
+                writer->game->players[0]->moveCounter = item->moveCounters[0];
+                writer->game->players[1]->moveCounter = item->moveCounters[1];
+                // a frame with more items queued behind it is out of date
+                // by the time it would be written
+                if (item->final || !writer->dropFrames
+                        || __atomic_load_n(&writer->head, __ATOMIC_SEQ_CST)
+                            == tail + 1) {
+                    print_game(writer->game);
+                }
+                if (writer->autosaveName != NULL
+                        && ++framesSinceSave >= AUTOSAVE_INTERVAL) {
+                    autosave_game(writer);
+                    framesSinceSave = 0;
+                }
+                break;
+            case ITEM_LINE:
+                fputs(item->line, stdout);
+                break;
+            case ITEM_STOP:
+                if (writer->autosaveName != NULL && framesSinceSave > 0) {
+                    autosave_game(writer);
+                }
+                running = false;
+                break;
+        }
+        // flush once the queue runs dry, before the game thread can see it
+        // empty, so a drained queue always means the output is written
+        if (!running || __atomic_load_n(&writer->head, __ATOMIC_SEQ_CST)
+                == tail + 1) {
+            fflush(stdout);
+        }
+        __atomic_store_n(&writer->tail, ++tail, __ATOMIC_SEQ_CST);
+        wake_writer_sleepers(writer);
     }
-    fflush(outputFile);
-    fclose(outputFile);
+    return NULL;
+}
+
+/**
+    Starts the output thread for the game, from a copy of its current
+    board. Returns NULL if it could not be started, in which case the game
+    prints and saves synchronously.
+    @param dropFrames true if the writer should skip board frames while
+        more items are queued behind them.
+    @param autosaveName file to autosave the game to, or NULL
+**/
+Writer* start_writer(Game* game, bool dropFrames, const char* autosaveName) {
+    Writer* writer = malloc(sizeof(Writer));
+    writer->game = initialize_game(game->height, game->width);
+    for (int i = 0; i < game->height; i++) {
+        memcpy(writer->game->board[i], game->board[i], game->width);
+    }
+    writer->head = 0;
+    writer->tail = 0;
+    writer->sleepers = 0;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->changed, NULL);
+    writer->dropFrames = dropFrames;
+    writer->autosaveName = autosaveName;
+    writer->autosaveFailed = false;
+    if (pthread_create(&writer->thread, NULL, run_writer, writer) != 0) {
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->changed);
+        free_game(writer->game);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+/**
+    Returns the next free item in the queue, waiting for one if the queue
+    is full
+**/
+WriterItem* reserve_item(Writer* writer) {
+    wait_for_writer(writer, WAIT_SPACE);
+    return &writer->items[writer->head % WRITER_CAPACITY];
+}
+
+/**
+    Hands the item last reserved over to the writer thread
+**/
+void publish_item(Writer* writer) {
+    __atomic_store_n(&writer->head, writer->head + 1, __ATOMIC_SEQ_CST);
+    wake_writer_sleepers(writer);
+}
+
+/**
+    Passes a stone placed on the board on to the writer, if there is one
+**/
+void write_move(Game* game, int row, int column, char value) {
+    if (game->writer == NULL) {
+        return;
+    }
+    WriterItem* item = reserve_item(game->writer);
+    item->type = ITEM_MOVE;
+    item->row = row;
+    item->column = column;
+    item->value = value;
+    publish_item(game->writer);
+}
+
+/**
+    Prints the game board through the writer, or directly if there is none.
+    Frames that are not 'final' may be dropped by the writer.
+**/
+void write_frame(Game* game, bool final) {
+    if (game->writer == NULL) {
+        print_game(game);
+        return;
+    }
+    WriterItem* item = reserve_item(game->writer);
+    item->type = ITEM_FRAME;
+    item->isXTurn = game->isXTurn;
+    item->moveCounters[0] = game->players[0]->moveCounter;
+    item->moveCounters[1] = game->players[1]->moveCounter;
+    item->final = final;
+    publish_item(game->writer);
+}
+
+/**
+    Prints a formatted line through the writer, or directly if there is
+    none. Lines are never dropped.
+**/
+void write_line(Game* game, const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    if (game->writer == NULL) {
+        vprintf(format, arguments);
+    } else {
+        WriterItem* item = reserve_item(game->writer);
+        item->type = ITEM_LINE;
+        vsnprintf(item->line, sizeof(item->line), format, arguments);
+        publish_item(game->writer);
+    }
+    va_end(arguments);
+}
+
+/**
+    Waits until everything published so far has been written out
+**/
+void drain_writer(Writer* writer) {
+    if (writer == NULL) {
+        return;
+    }
+    wait_for_writer(writer, WAIT_DRAINED);
+}
+
+/**
+    Writes out everything still queued, stops the writer thread and frees
+    its resources
+**/
+void stop_writer(Writer* writer) {
+    if (writer == NULL) {
+        return;
+    }
+    WriterItem* item = reserve_item(writer);
+    item->type = ITEM_STOP;
+    publish_item(writer);
+    pthread_join(writer->thread, NULL);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->changed);
+    free_game(writer->game);
+    free(writer);
+}
+
+/**
+    Returns the formula segment the current player is in. The formula's
+    move counter is multiplied by a step and taken modulo a prime; between
+    two wraps of that modulus the moves repeat with a period of at most
+    m * height * width.
+**/
+long long formula_segment(Game* game, long long* step, long long* modulus) {
+    // constants of get_auto_move_for_x and get_auto_move_for_o
+    *step = game->isXTurn ? 7 : 9;
+    *modulus = game->isXTurn ? 1000213 : 1000037;
+    return game->players[game->isXTurn]->moveCounter * *step / *modulus;
+}
+
+/**
+    Generates the move for a computer player: the book move if the player
+    uses the book and it knows the position, the formula move otherwise.
+    Once the formula has gone through a whole period without finding an
+    empty cell, its counter jumps to the next wrap of the modulus, which
+    is where it would first produce a new move.
+**/
+void get_auto_move(Player* player, Game* game, int* height, int* width) {
+    int m = (game->height >= game->width) ? game->height : game->width;
+    long long period = (long long)m * game->height * game->width;
+    long long step, modulus, tried = 0;
+    long long segment = formula_segment(game, &step, &modulus);
+    do {
+        if (tried == period) {
+            game->players[game->isXTurn]->moveCounter =
+                    ((segment + 1) * modulus + step - 1) / step;
+        }
+        if (!player->useBook
+                || !get_book_move(game->book, game, height, width)) {
+            if (game->isXTurn) {
+                get_auto_move_for_x(height, width, game);
+            } else {
+                get_auto_move_for_o(height, width, game);
+            }
+        }
+        long long next = formula_segment(game, &step, &modulus);
+        tried = (next == segment) ? tried + 1 : 0;
+        segment = next;
+    } while (!is_move_valid(*height, *width, game));
+}
+
+/**
+    Places the stone 'value' on the board and returns true if the
+    game is over after the move
+**/
+bool play_move(Game* game, int row, int column, char value) {
+    game->board[row][column] = value;
+    game->hash ^= cell_key(row, column, value);
+    return check_game_over(row, column, value, game);
 }
 
 /**
@@ -584,6 +1750,7 @@ bool get_move(Player* player, Game* game) {
     int width = -1;
     do {
         if (player->isManual) {
+            drain_writer(game->writer);
             printf("Player %c] ", player->playerName);
             char buffer[70];
             if (fgets(buffer, 65, stdin) == NULL) {
@@ -593,7 +1760,7 @@ bool get_move(Player* player, Game* game) {
                 buffer[strlen(buffer) - 1] = '\0';
             }
             if (buffer[0] == 's') {
-                save_game(game, buffer);
+                save_game(game, buffer + 1);
                 continue;
             }
             int tokenCount = 0;
@@ -611,18 +1778,16 @@ bool get_move(Player* player, Game* game) {
                 width = -1;
             }
         } else {
-            if (game->isXTurn) {
-                get_auto_move_for_x(&height, &width, game);
-            } else {
-                get_auto_move_for_o(&height, &width, game);
-            }
+            get_auto_move(player, game, &height, &width);
         }
     } while (!is_move_valid(height, width, game));
-    game->board[height][width] = player->playerName;
+    bool isGameOver = play_move(game, height, width, player->playerName);
+    write_move(game, height, width, player->playerName);
     if (!player->isManual) {
-        printf("Player %c => %d %d\n", player->playerName, height, width);
+        write_line(game, "Player %c => %d %d\n", player->playerName, height,
+                width);
     }
-    return check_game_over(height, width, player->playerName, game);
+    return isGameOver;
 }
 
 /**
@@ -637,25 +1802,521 @@ int start_game(Game* game) {
             isGameOver = get_move(game->players[0], game);
         }
         game->isXTurn = !game->isXTurn;
+        write_frame(game, isGameOver);
+    }
+    write_line(game, "Player %c wins\n", game->winner);
+    stop_writer(game->writer);
+    free_game(game);
+    return 0;
+}
+
+/**
+    Number of random moves each tournament game opens with by default,
+    and the log header line that records it
+**/
+#define OPENING_PLIES 2
+#define OPENING_HEADER "# opening plies %d\n"
+
+/**
+    Elo differences tested against each other by the sequential probability
+    ratio test, its error rates, and the count added to every pair score:
+    one pair spread over the five scores, so a run of equal pairs does
+    not shrink the variance to zero and stop the test after a few games
+**/
+#define SPRT_ELO0 0.0
+#define SPRT_ELO1 20.0
+#define SPRT_ALPHA 0.05
+#define SPRT_BETA 0.05
+#define SPRT_PRIOR 0.2
+
+/**
+    The moves and result of one tournament game
+**/
+typedef struct GameRecord {
+    // seed the random opening of the game was generated from
+    uint64_t seed;
+    char winner;
+    // the moves in order, as row * width + column
+    int* moves;
+    int moveCount;
+} GameRecord;
+
+/**
+    A tournament between two computer player types, 'A' and 'B'. Games are
+    played on every core, but their results are counted and logged in
+    game order, so the outcome does not depend on the number of threads.
+**/
+typedef struct Tournament {
+    char* playerTypes[2];
+    int height;
+    int width;
+    int maxGames;
+    uint64_t seed;
+    // number of random moves each game opens with
+    int openingPlies;
+    // opening book shared by every game, NULL if no player uses it
+    Book* book;
+    FILE* log;
+    // index of the next game to hand out to a thread
+    int nextGame;
+    pthread_mutex_t lock;
+    // the fields below are protected by 'lock'
+    GameRecord** records;
+    // number of games counted, all of them before any game still running.
+    // Records are freed once counted.
+    int counted;
+    int wins[2];
+    // A's wins in the first game of the pair being counted
+    int pairWins;
+    // number of pairs in which A scored 0, 1/2, 1, 3/2 and 2 points
+    int pairs[5];
+    double llr;
+    // -1 if the test accepted elo0, 1 if it accepted elo1, 0 if undecided
+    int decision;
+} Tournament;
+
+/**
+    Returns the expected score for an Elo difference of 'elo'
+**/
+double elo_to_score(double elo) {
+    return 1.0 / (1.0 + pow(10.0, -elo / 400.0));
+}
+
+/**
+    Returns the Elo difference for an expected score of 'score'
+**/
+double score_to_elo(double score) {
+    if (score <= 0.0) {
+        return -INFINITY;
+    }
+    if (score >= 1.0) {
+        return INFINITY;
+    }
+    return -400.0 * log10(1.0 / score - 1.0);
+}
+
+/**
+    Plays game 'index' of the tournament, opening with random moves
+    generated from 'seed'. A plays O in even games and X in odd ones.
+**/
+GameRecord* play_seeded_game(Tournament* tournament, int index,
+        uint64_t seed) {
+    Game* game = initialize_game(tournament->height, tournament->width);
+    game->book = tournament->book;
+    initialize_player(tournament->playerTypes[0], game->players[index % 2], 0);
+    initialize_player(tournament->playerTypes[1],
+            game->players[1 - index % 2], 0);
+
+    GameRecord* record = malloc(sizeof(GameRecord));
+    record->seed = seed;
+    record->moves = malloc(sizeof(int) * game->height * game->width);
+    record->moveCount = 0;
+    uint64_t random = record->seed;
+    bool isGameOver = false;
+    while (!isGameOver) {
+        int row = -1, column = -1;
+        Player* player = game->players[game->isXTurn];
+        if (record->moveCount < tournament->openingPlies) {
+            // pick the n-th empty cell
+            int n = (int)(next_random(&random) % (uint64_t)(game->height
+                    * game->width - record->moveCount));
+            for (int cell = 0; n >= 0; cell++) {
+                row = cell / game->width;
+                column = cell % game->width;
+                if (game->board[row][column] == '.') {
+                    n--;
+                }
+            }
+        } else {
+            get_auto_move(player, game, &row, &column);
+        }
+        record->moves[record->moveCount++] = row * game->width + column;
+        isGameOver = play_move(game, row, column, player->playerName);
+        game->isXTurn = !game->isXTurn;
+    }
+    record->winner = game->winner;
+    game->book = NULL;
+    free_game(game);
+    return record;
+}
+
+/**
+    Plays game 'index' of the tournament. Each pair of games starts from
+    the same random opening, with A and B swapping colours. The tournament
+    seed is mixed before the pair number is added, so neighbouring seeds
+    do not share openings.
+**/
+GameRecord* play_tournament_game(Tournament* tournament, int index) {
+    return play_seeded_game(tournament, index,
+            mix64(mix64(tournament->seed) ^ (uint64_t)(index / 2)));
+}
+
+/**
+    Frees the game record resources
+**/
+void free_game_record(GameRecord* record) {
+    if (record != 0) {
+        free(record->moves);
+        free(record);
+    }
+}
+
+/**
+    Writes a game to the tournament log as a single line:
+    index seed height width O-type X-type winner row,column...
+**/
+void log_game(Tournament* tournament, int index, GameRecord* record) {
+    fprintf(tournament->log, "%d %016llx %d %d %s %s %c", index,
+            (unsigned long long)record->seed, tournament->height,
+            tournament->width,
+            tournament->playerTypes[index % 2],
+            tournament->playerTypes[1 - index % 2], record->winner);
+    for (int i = 0; i < record->moveCount; i++) {
+        fprintf(tournament->log, " %d,%d", record->moves[i] / tournament->width,
+                record->moves[i] % tournament->width);
+    }
+    fprintf(tournament->log, "\n");
+}
+
+/**
+    Computes the mean and variance of A's score per game over the pairs
+    counted so far, treating each pair as one trial with five outcomes,
+    since the two games of a pair share their opening.
+    Returns the number of pairs, including the SPRT_PRIOR counts.
+**/
+double pair_statistics(Tournament* tournament, double* mean,
+        double* variance) {
+    double counts[5], pairs = 0, sum = 0, squares = 0;
+    for (int i = 0; i < 5; i++) {
+        counts[i] = tournament->pairs[i] + SPRT_PRIOR;
+        pairs += counts[i];
+        sum += counts[i] * i / 4.0;
+        squares += counts[i] * (i / 4.0) * (i / 4.0);
+    }
+    *mean = sum / pairs;
+    *variance = squares / pairs - *mean * *mean;
+    return pairs;
+}
+
+/**
+    Counts and logs the finished games that directly follow the games
+    already counted, and updates the sequential probability ratio test
+    after every finished pair.
+    Must be called with the tournament lock held.
+**/
+void count_finished_games(Tournament* tournament) {
+    const double score0 = elo_to_score(SPRT_ELO0);
+    const double score1 = elo_to_score(SPRT_ELO1);
+    const double lower = log(SPRT_BETA / (1.0 - SPRT_ALPHA));
+    const double upper = log((1.0 - SPRT_BETA) / SPRT_ALPHA);
+    while (__atomic_load_n(&tournament->decision, __ATOMIC_RELAXED) == 0
+            && tournament->counted < tournament->maxGames
+            && tournament->records[tournament->counted] != NULL) {
+        int index = tournament->counted++;
+        GameRecord* record = tournament->records[index];
+        // A plays O in even games
+        bool aWins = (record->winner == 'O') == (index % 2 == 0);
+        tournament->wins[aWins ? 0 : 1]++;
+        log_game(tournament, index, record);
+        free_game_record(record);
+        tournament->records[index] = NULL;
+        if (index % 2 == 0) {
+            tournament->pairWins = aWins;
+            continue;
+        }
+        // a game has no draws, so a pair scores 0, 1 or 2 points
+        tournament->pairs[2 * (tournament->pairWins + aWins)]++;
+        double mean, variance;
+        double pairs = pair_statistics(tournament, &mean, &variance);
+        // normal approximation of the log likelihood ratio
+        tournament->llr = pairs * (score1 - score0)
+                * (2.0 * mean - score0 - score1) / (2.0 * variance);
+        // threads check the decision without the lock before each game
+        if (tournament->llr >= upper) {
+            __atomic_store_n(&tournament->decision, 1, __ATOMIC_RELAXED);
+        } else if (tournament->llr <= lower) {
+            __atomic_store_n(&tournament->decision, -1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+    Plays tournament games on one thread until every game has been handed
+    out or the test has reached a decision
+**/
+void* run_tournament_thread(void* argument) {
+    Tournament* tournament = argument;
+    while (true) {
+        int index = __atomic_fetch_add(&tournament->nextGame, 1,
+                __ATOMIC_RELAXED);
+        if (index >= tournament->maxGames
+                || __atomic_load_n(&tournament->decision, __ATOMIC_RELAXED)) {
+            break;
+        }
+        GameRecord* record = play_tournament_game(tournament, index);
+        pthread_mutex_lock(&tournament->lock);
+        tournament->records[index] = record;
+        count_finished_games(tournament);
+        pthread_mutex_unlock(&tournament->lock);
+    }
+    return NULL;
+}
+
+/**
+    Prints the score, Elo estimate and test result of the tournament
+**/
+void print_tournament(Tournament* tournament) {
+    printf("Games: %d, %s %d - %d %s\n", tournament->counted,
+            tournament->playerTypes[0], tournament->wins[0],
+            tournament->wins[1], tournament->playerTypes[1]);
+    printf("Pairs scoring 0, 1/2, 1, 3/2, 2: %d %d %d %d %d\n",
+            tournament->pairs[0], tournament->pairs[1], tournament->pairs[2],
+            tournament->pairs[3], tournament->pairs[4]);
+    double mean, variance;
+    double pairs = pair_statistics(tournament, &mean, &variance);
+    if (tournament->counted >= 2) {
+        // 95% confidence interval of the score, converted to Elo
+        double margin = 1.96 * sqrt(variance / pairs);
+        printf("Elo: %+.1f [%+.1f, %+.1f]\n", score_to_elo(mean),
+                score_to_elo(mean - margin), score_to_elo(mean + margin));
+    }
+    printf("SPRT elo0 %.0f elo1 %.0f: LLR %.2f [%.2f, %.2f] %s\n",
+            SPRT_ELO0, SPRT_ELO1, tournament->llr,
+            log(SPRT_BETA / (1.0 - SPRT_ALPHA)),
+            log((1.0 - SPRT_BETA) / SPRT_ALPHA),
+            tournament->decision > 0 ? "H1 accepted"
+            : tournament->decision < 0 ? "H0 accepted" : "inconclusive");
+}
+
+/**
+    Returns true if 'type' names a computer player type
+**/
+bool is_computer_type(const char* type) {
+    return strlen(type) == 1 && is_player_type_valid(type[0])
+            && type[0] != 'm';
+}
+
+/**
+    Loads the opening book for a tournament if either player type uses it.
+    Returns false if a book is needed but could not be loaded.
+**/
+bool load_tournament_book(Tournament* tournament) {
+    tournament->book = NULL;
+    if (tournament->playerTypes[0][0] != 'b'
+            && tournament->playerTypes[1][0] != 'b') {
+        return true;
+    }
+    const char* bookName = getenv("HEX_BOOK");
+    Game* game = initialize_game(tournament->height, tournament->width);
+    tournament->book = load_book(bookName ? bookName : "hex.book", game);
+    free_game(game);
+    return tournament->book != NULL;
+}
+
+/**
+    Handles 'hex tournament p1type p2type height width logfile
+    [games [seed [openingPlies]]]'
+**/
+int tournament_command(int argc, char** argv) {
+    if (argc < 7 || argc > 10) {
+        return show_error_message(TOURNAMENT_USAGE);
+    }
+    Tournament tournament;
+    memset(&tournament, 0, sizeof(Tournament));
+    tournament.playerTypes[0] = argv[2];
+    tournament.playerTypes[1] = argv[3];
+    if (!is_computer_type(argv[2]) || !is_computer_type(argv[3])) {
+        return show_error_message(PLAYER_TYPE);
+    }
+    tournament.height = parse_number(argv[4], 1, 1000);
+    tournament.width = parse_number(argv[5], 1, 1000);
+    if (tournament.height < 0 || tournament.width < 0) {
+        return show_error_message(GRID_DIMENSIONS);
+    }
+    tournament.maxGames = (argc > 7) ? parse_number(argv[7], 1, 1000000)
+            : 10000;
+    int seed = (argc > 8) ? parse_number(argv[8], 0, 2147483647) : 1;
+    tournament.openingPlies = (argc > 9) ? parse_number(argv[9], 0,
+            tournament.height * tournament.width) : OPENING_PLIES;
+    if (tournament.maxGames < 0 || seed < 0 || tournament.openingPlies < 0) {
+        return show_error_message(TOURNAMENT_USAGE);
+    }
+    // only whole pairs are scored
+    tournament.maxGames += tournament.maxGames % 2;
+    tournament.seed = seed;
+    if (!load_tournament_book(&tournament)) {
+        return show_error_message(BOOK_READ);
+    }
+    tournament.log = fopen(argv[6], "w");
+    if (tournament.log == NULL) {
+        free_book(tournament.book);
+        return show_error_message(TOURNAMENT_LOG);
+    }
+    fprintf(tournament.log, OPENING_HEADER, tournament.openingPlies);
+    fprintf(tournament.log, "# game seed height width O X winner moves\n");
+    tournament.records = calloc(tournament.maxGames, sizeof(GameRecord*));
+    pthread_mutex_init(&tournament.lock, NULL);
+
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    pthread_t* threads = malloc(sizeof(pthread_t) * threadCount);
+    int started = 0;
+    for (; started < threadCount; started++) {
+        if (pthread_create(&threads[started], NULL, run_tournament_thread,
+                &tournament) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        run_tournament_thread(&tournament);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    print_tournament(&tournament);
+
+    // games finished after the test decided are never counted
+    for (int i = tournament.counted; i < tournament.maxGames; i++) {
+        free_game_record(tournament.records[i]);
+    }
+    free(tournament.records);
+    free(threads);
+    pthread_mutex_destroy(&tournament.lock);
+    fclose(tournament.log);
+    free_book(tournament.book);
+    return 0;
+}
+
+/**
+    Handles 'hex replay logfile game'. Prints a game from a tournament log
+    move by move, then plays it again from its seed, with the number of
+    opening plies given in the log header, and reports whether the
+    engines still make the same moves.
+**/
+int replay_command(int argc, char** argv) {
+    if (argc != 4) {
+        return show_error_message(REPLAY_USAGE);
+    }
+    int index = parse_number(argv[3], 0, 1000000);
+    if (index < 0) {
+        return show_error_message(REPLAY_USAGE);
+    }
+    FILE* log = fopen(argv[2], "r");
+    if (log == NULL) {
+        return show_error_message(FILE_READ);
+    }
+    char* line = NULL;
+    size_t lineSize = 0;
+    int lineIndex = -1, offset = 0;
+    unsigned long long seed = 0;
+    char types[2][2];
+    char winner = '.';
+    Tournament tournament;
+    memset(&tournament, 0, sizeof(Tournament));
+    // logs written before the header existed used the default
+    tournament.openingPlies = OPENING_PLIES;
+    while (getline(&line, &lineSize, log) >= 0) {
+        if (sscanf(line, OPENING_HEADER, &tournament.openingPlies) == 1) {
+            continue;
+        }
+        if (line[0] != '#' && sscanf(line, "%d %llx %d %d %1s %1s %c %n",
+                &lineIndex, &seed, &tournament.height, &tournament.width,
+                types[0], types[1], &winner, &offset) == 7
+                && lineIndex == index) {
+            break;
+        }
+        lineIndex = -1;
+    }
+    fclose(log);
+    if (lineIndex < 0 || !is_computer_type(types[0])
+            || !is_computer_type(types[1]) || tournament.height <= 0
+            || tournament.height > 1000 || tournament.width <= 0
+            || tournament.width > 1000) {
+        free(line);
+        return show_error_message(INVALID_FILE);
+    }
+    // A is the O player in even games
+    tournament.playerTypes[0] = types[index % 2];
+    tournament.playerTypes[1] = types[1 - index % 2];
+    if (!load_tournament_book(&tournament)) {
+        free(line);
+        return show_error_message(BOOK_READ);
+    }
+
+    Game* game = initialize_game(tournament.height, tournament.width);
+    int* moves = malloc(sizeof(int) * tournament.height * tournament.width);
+    int moveCount = 0;
+    bool isGameOver = false;
+    print_game(game);
+    for (char* move = strtok(line + offset, " \n"); move != NULL
+            && !isGameOver; move = strtok(NULL, " \n")) {
+        int row = -1, column = -1;
+        if (sscanf(move, "%d,%d", &row, &column) != 2
+                || !is_move_valid(row, column, game)) {
+            break;
+        }
+        char value = game->isXTurn ? 'X' : 'O';
+        moves[moveCount++] = row * game->width + column;
+        isGameOver = play_move(game, row, column, value);
+        game->isXTurn = !game->isXTurn;
+        printf("Player %c => %d %d\n", value, row, column);
         print_game(game);
     }
+    free(line);
+    if (!isGameOver || game->winner != winner) {
+        free(moves);
+        free_game(game);
+        free_book(tournament.book);
+        return show_error_message(INVALID_FILE);
+    }
     printf("Player %c wins\n", game->winner);
+
+    GameRecord* record = play_seeded_game(&tournament, index, seed);
+    bool reproduced = record->moveCount == moveCount
+            && memcmp(record->moves, moves, sizeof(int) * moveCount) == 0;
+    printf("Replay from seed %016llx %s\n", seed,
+            reproduced ? "matches" : "differs");
+    free_game_record(record);
+    free(moves);
     free_game(game);
+    free_book(tournament.book);
     return 0;
 }
 
+/**
+    Returns true if 'type' names a player type: m(anual), a(uto) or
+    b(ook), which plays book moves and falls back to the auto moves
+**/
+bool is_player_type_valid(char type) {
+    return type == 'm' || type == 'a' || type == 'b';
+}
+
 /**
     The main function of the program
 **/
 int main(int argc, char** argv) {
+    if (argc >= 2 && strcmp(argv[1], "book") == 0) {
+        return build_book_command(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        return bench_command(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "tournament") == 0) {
+        return tournament_command(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "replay") == 0) {
+        return replay_command(argc, argv);
+    }
     if ((argc != 4) && (argc != 5)) {
         return show_error_message(USAGE);
     }
     if ((strlen(argv[1]) != 1) || (strlen(argv[2]) != 1)) {
         return show_error_message(PLAYER_TYPE);
     }
-    if (((argv[1][0] != 'm') && (argv[1][0] != 'a')) || 
-            ((argv[2][0] != 'm') && (argv[2][0] != 'a'))) {
+    if (!is_player_type_valid(argv[1][0])
+            || !is_player_type_valid(argv[2][0])) {
         return show_error_message(PLAYER_TYPE);
     }
     int height, width;
@@ -683,7 +2344,19 @@ int main(int argc, char** argv) {
     }
     initialize_player(argv[1], game->players[0], 0);
     initialize_player(argv[2], game->players[1], 0);
-    print_game(game);
+    if (game->players[0]->useBook || game->players[1]->useBook) {
+        const char* bookName = getenv("HEX_BOOK");
+        game->book = load_book(bookName ? bookName : "hex.book", game);
+        if (game->book == NULL) {
+            free_game(game);
+            return show_error_message(BOOK_READ);
+        }
+    }
+    const char* backpressure = getenv("HEX_BACKPRESSURE");
+    game->writer = start_writer(game,
+            backpressure != NULL && strcmp(backpressure, "drop") == 0,
+            getenv("HEX_AUTOSAVE"));
+    write_frame(game, true);
 
     return start_game(game);
 }
@@ -693,25 +2366,27 @@ int main(int argc, char** argv) {
 **/
 void free_game(Game* game) {
     if (game != 0) {
-        for (int i = 0; i < game->height; i++) {
-            free(game->board[i]);
-        }
         free(game->board);
+        free(game->cells);
+        free(game->visited);
+        free(game->flood);
+        free(game->scratch);
+        free(game->frame);
         free(game->players[0]);
         free(game->players[1]);
+        free_book(game->book);
         free(game);
     }
 }
 
 /**
-    Frees the stack resources
+    Unmaps the opening book and frees its resources
 **/
-void free_stack(Stack* stack) {
-    free(stack->rows);
-    free(stack->columns);
-    free(stack->rowLog);
-    free(stack->columnLog);
-    free(stack);
+void free_book(Book* book) {
+    if (book != 0) {
+        munmap(book->map, book->mapSize);
+        free(book);
+    }
 }
 
 /**